@@ -1,8 +1,13 @@
+#include <cerrno>
+#include <cstdlib>
 #include <fstream>
 #include <iostream>
 #include <string>
+#include <vector>
 
 #include <rapidjson/document.h>
+#include <rapidjson/error/en.h>
+#include <rapidjson/memorystream.h>
 #include <rapidjson/stringbuffer.h>
 #include <rapidjson/writer.h>
 
@@ -12,6 +17,16 @@
 
 #include "msgpack/type/rapidjson.hpp"
 #include "msgpack/type/jsoncpp.hpp"
+#include "server.hpp"
+
+// Server mode needs unpack_limit and the zone-based unpack from msgpack-c,
+// and MemoryStream and Writer::Reset from RapidJSON.
+#if MSGPACK_VERSION_MAJOR < 1 || (MSGPACK_VERSION_MAJOR == 1 && MSGPACK_VERSION_MINOR < 2)
+#error "xchange requires msgpack-c 1.2 or later (CI pins cpp-1.4.2)"
+#endif
+#if !defined(RAPIDJSON_MAJOR_VERSION) || RAPIDJSON_MAJOR_VERSION < 1 || (RAPIDJSON_MAJOR_VERSION == 1 && RAPIDJSON_MINOR_VERSION < 1)
+#error "xchange requires RapidJSON 1.1 or later (CI pins v1.1.0)"
+#endif
 
 using namespace rapidjson;
 using namespace msgpack;
@@ -39,38 +54,69 @@ struct Opt {
     FileFormat src;
     FileFormat dest;
     std::string executable;
+    std::string serve;   // socket path, or "-" for stdin/stdout
+    std::string connect; // socket path of a running server
+    size_t threads;
     bool help;
 
     bool parse(int argc, char* argv[])
     {
         executable = program(argv[0]);
-        std::cout << executable << std::endl;
-
-        if (argc != 4)
-        {
-            usage();
-            return false;
-        }
-
+        threads = xchange::server::default_threads();
+        threadsGiven = false;
 
         for (int i = 1; i < argc; i++)
         {
             std::string arg(argv[i]);
-            if (arg == "-o")
+            if (arg == "-o" || arg == "--serve" || arg == "--connect" || arg == "--threads")
             {
-                if (i == argc - 1) // last arg should not be "-o"
+                if (i == argc - 1) // these options should not be the last arg
                 {
                     usage();
                     return false;
                 }
 
-                dest.filename = argv[++i];
+                std::string value(argv[++i]);
+                if (arg == "-o")
+                    dest.filename = value;
+                else if (arg == "--serve")
+                    serve = value;
+                else if (arg == "--connect")
+                    connect = value;
+                else if (!parseThreads(value))
+                {
+                    usage();
+                    return false;
+                }
             }
-            else
+            else if (src.filename.empty())
                 src.filename = arg;
+            else
+            {
+                std::cerr << "Unexpected argument: " << arg << std::endl;
+                usage();
+                return false;
+            }
+        }
+
+        if (!serve.empty())
+        {
+            if (!connect.empty() || !src.filename.empty() || !dest.filename.empty())
+            {
+                std::cerr << "--serve takes no --connect, -o or input file" << std::endl;
+                usage();
+                return false;
+            }
+            return true;
+        }
+        if (threadsGiven)
+        {
+            std::cerr << "--threads only applies to --serve" << std::endl;
+            usage();
+            return false;
         }
 
-        if (src.filename.empty() && dest.filename.empty())
+        if (src.filename.empty() || dest.filename.empty())
         {
             usage();
             return false;
@@ -91,9 +137,28 @@ struct Opt {
     }
 
 private:
+    bool threadsGiven;
+
+    bool parseThreads(const std::string& value)
+    {
+        // More workers than this only adds contention.
+        const long limit = static_cast<long>(4 * xchange::server::default_threads());
+        char* end = NULL;
+        errno = 0;
+        long n = strtol(value.c_str(), &end, 10);
+        if (value.empty() || *end != '\0' || errno == ERANGE || n <= 0 || n > limit)
+        {
+            std::cerr << "Invalid thread count: " << value << " (expected 1 to " << limit << ")" << std::endl;
+            return false;
+        }
+        threads = static_cast<size_t>(n);
+        threadsGiven = true;
+        return true;
+    }
     void usage() const
     {
-        std::cerr << "Usage " << executable << " -o <outfile> <inputfile>" << std::endl;;
+        std::cerr << "Usage " << executable << " [--connect <socket>] -o <outfile> <inputfile>" << std::endl;
+        std::cerr << "      " << executable << " --serve <socket>|- [--threads <n>]" << std::endl;
     }
     bool getFormat(const std::string& filename, FileFormat::Format* f)
     {
@@ -233,6 +298,188 @@ bool convert(const std::string& sf, const std::string& df)
     return Dest::save(doc, df);
 }
 
+// Output stream for both msgpack::packer and rapidjson::Writer that appends
+// straight to a response buffer, so converted bytes are not copied again.
+struct ResponseStream {
+    typedef char Ch;
+    ResponseStream() : buffer(NULL) {}
+    void write(const char* data, size_t size) { buffer->append(data, size); }
+    void Put(char c) { buffer->push_back(c); }
+    void Flush() {}
+    std::string* buffer;
+};
+
+// Handler for server mode, one instance per worker thread. RapidJSON documents
+// are built in memory pools backed by arenas owned by the worker, msgpack
+// objects live in a zone that is cleared rather than freed, and output goes
+// directly into the session's reused response buffer.
+//
+// Unlike the CLI, which goes through jsoncpp, this writes compact JSON and
+// keeps object members in document order.
+struct Converter {
+    typedef rapidjson::MemoryPoolAllocator<> Allocator;
+    typedef rapidjson::GenericDocument<rapidjson::UTF8<>, Allocator, Allocator> Document;
+    static const size_t kArenaSize = 64 * 1024;
+    static const size_t kStackCapacity = 1024;
+    // The msgpack adapters and the writers recurse, so nesting is bounded to
+    // keep untrusted payloads from overflowing the worker stack.
+    static const size_t kMaxDepth = 256;
+
+    Converter()
+        : valueArena(kArenaSize)
+        , stackArena(kArenaSize)
+        , valueAllocator(&valueArena[0], valueArena.size())
+        , stackAllocator(&stackArena[0], stackArena.size())
+        , writer(stream)
+    {}
+
+    void operator()(const std::string& request, std::string* response)
+    {
+        response->assign(1, static_cast<char>(xchange::server::SUCCEEDED));
+        stream.buffer = response;
+        std::string error;
+        bool rv = false;
+        try
+        {
+            if (request.size() < 2)
+                error = "Truncated request";
+            else if (request[0] == FileFormat::JSON && request[1] == FileFormat::MSGPACK)
+                rv = jsonToMsgpack(request.data() + 2, request.size() - 2, &error);
+            else if (request[0] == FileFormat::MSGPACK && request[1] == FileFormat::JSON)
+                rv = msgpackToJson(request.data() + 2, request.size() - 2, &error);
+            else
+                error = "Unsupported conversion";
+        }
+        catch (const std::exception& e)
+        {
+            error = e.what();
+        }
+        // Drop this message's documents; only the arenas and the zone's
+        // first chunk stay allocated.
+        valueAllocator.Clear();
+        stackAllocator.Clear();
+        zone.clear();
+
+        if (!rv)
+        {
+            response->assign(1, static_cast<char>(xchange::server::FAILED));
+            response->append(error);
+        }
+    }
+
+private:
+    Converter(const Converter&);
+    Converter& operator=(const Converter&);
+
+    bool jsonToMsgpack(const char* json, size_t size, std::string* error)
+    {
+        if (!withinDepth(json, json + size))
+        {
+            *error = "JSON nested too deeply";
+            return false;
+        }
+        rapidjson::MemoryStream in(json, size);
+        Document doc(&valueAllocator, kStackCapacity, &stackAllocator);
+        doc.ParseStream<rapidjson::kParseIterativeFlag>(in);
+        if (doc.HasParseError())
+        {
+            *error = rapidjson::GetParseError_En(doc.GetParseError());
+            return false;
+        }
+        if (in.Tell() != size) // e.g. an embedded NUL ended the parse early
+        {
+            *error = "Unexpected data after the JSON document";
+            return false;
+        }
+        msgpack::pack(stream, doc);
+        return true;
+    }
+
+    bool msgpackToJson(const char* data, size_t size, std::string* error)
+    {
+        // No element can take less than a byte, so no count may exceed `size`.
+        msgpack::unpack_limit limit(size, size, size, size, size, kMaxDepth);
+        size_t offset = 0;
+        bool referenced = false;
+        msgpack::object object = msgpack::unpack(zone, data, size, offset, referenced, NULL, NULL, limit);
+        if (offset != size)
+        {
+            *error = "Unexpected data after the msgpack object";
+            return false;
+        }
+        Document doc(&valueAllocator, kStackCapacity, &stackAllocator);
+        object.convert(&doc);
+
+        writer.Reset(stream);
+        if (!doc.Accept(writer)) // the writer stops at values JSON cannot hold
+        {
+            *error = "NaN/Inf cannot be represented in JSON";
+            return false;
+        }
+        return true;
+    }
+
+    // Cheap pre-scan so that neither parsing nor packing recurses too deep.
+    static bool withinDepth(const char* p, const char* end)
+    {
+        size_t depth = 0;
+        bool inString = false;
+        for (; p < end; ++p)
+        {
+            if (inString)
+            {
+                if (*p == '\\')
+                    ++p;
+                else if (*p == '"')
+                    inString = false;
+            }
+            else if (*p == '"')
+                inString = true;
+            else if (*p == '[' || *p == '{')
+            {
+                if (++depth > kMaxDepth)
+                    return false;
+            }
+            else if ((*p == ']' || *p == '}') && depth > 0)
+                --depth;
+        }
+        return true;
+    }
+
+    std::vector<char> valueArena;
+    std::vector<char> stackArena;
+    Allocator valueAllocator;
+    Allocator stackAllocator;
+    msgpack::zone zone;
+    ResponseStream stream;
+    Writer<ResponseStream> writer;
+};
+
+#ifndef _WIN32
+// Sends the conversion to a running `--serve <socket>` instance.
+bool convert_remote(const Opt& opt)
+{
+    std::string payload;
+    payload += static_cast<char>(opt.src.format);
+    payload += static_cast<char>(opt.dest.format);
+
+    std::string contents;
+    if (!read_file_contents(opt.src.filename, &contents))
+        return false;
+    payload += contents;
+
+    std::string response;
+    if (!xchange::server::request_unix(opt.connect, payload, &response) || response.empty())
+        return false;
+    if (response[0] != xchange::server::SUCCEEDED)
+    {
+        std::cerr << "Conversion failed: " << response.substr(1) << std::endl;
+        return false;
+    }
+    return write_file_contents(opt.dest.filename, response.substr(1));
+}
+#endif
+
 
 
 
@@ -241,6 +488,20 @@ int main(int argc, char* argv[])
     Opt opt;
     if (!opt.parse(argc, argv))
         return EXIT_FAILURE;
+    if (opt.serve == "-")
+        return xchange::server::serve_stream<Converter>(0, 1, opt.threads);
+#ifndef _WIN32
+    if (!opt.serve.empty())
+        return xchange::server::serve_unix<Converter>(opt.serve, opt.threads);
+    if (!opt.connect.empty())
+        return convert_remote(opt) ? EXIT_SUCCESS : EXIT_FAILURE;
+#else
+    if (!opt.serve.empty() || !opt.connect.empty())
+    {
+        std::cerr << "Unix domain sockets are not supported on this platform, use --serve -" << std::endl;
+        return EXIT_FAILURE;
+    }
+#endif
     if (opt.src.format == FileFormat::JSON && opt.dest.format == FileFormat::MSGPACK)
         return convert<Jsoncpp, Msgpack>(opt.src.filename, opt.dest.filename) ? EXIT_SUCCESS : EXIT_FAILURE;
     if (opt.src.format == FileFormat::MSGPACK && opt.dest.format == FileFormat::JSON)
@@ -18,6 +18,7 @@ namespace msgpack { MSGPACK_API_VERSION_NAMESPACE(MSGPACK_DEFAULT_API_NS) { name
                 case msgpack::type::BIN: v = Json::Value(o.via.bin.ptr, o.via.bin.ptr+o.via.bin.size); break;
                 case msgpack::type::STR: v = Json::Value(o.via.str.ptr, o.via.str.ptr+o.via.str.size); break;
                 case msgpack::type::ARRAY:{
+                    v = Json::Value(Json::arrayValue); // stays an array when empty
                     msgpack::object* ptr = o.via.array.ptr;
                     msgpack::object* END = ptr + o.via.array.size;
                     for (; ptr < END; ++ptr)
@@ -29,11 +30,15 @@ namespace msgpack { MSGPACK_API_VERSION_NAMESPACE(MSGPACK_DEFAULT_API_NS) { name
                 }
                     break;
                 case msgpack::type::MAP: {
+                    v = Json::Value(Json::objectValue); // stays an object when empty
                     msgpack::object_kv* ptr = o.via.map.ptr;
                     msgpack::object_kv* END = ptr + o.via.map.size;
                     for (; ptr < END; ++ptr)
                     {
-                        std::string key(ptr->key.via.str.ptr, ptr->key.via.str.size);
+                        const bool bin = (ptr->key.type == msgpack::type::BIN);
+                        if (!bin && ptr->key.type != msgpack::type::STR)
+                            throw msgpack::type_error(); // JSON object keys must be strings
+                        std::string key(bin ? ptr->key.via.bin.ptr : ptr->key.via.str.ptr, bin ? ptr->key.via.bin.size : ptr->key.via.str.size);
                         Json::Value& val = v[key];
                         ptr->val.convert(&val);
                     }
@@ -36,7 +36,10 @@ namespace msgpack { MSGPACK_API_VERSION_NAMESPACE(MSGPACK_DEFAULT_API_NS) { name
                     msgpack::object_kv* END = ptr + o.via.map.size;
                     for (; ptr < END; ++ptr)
                     {
-                        rapidjson::GenericValue<Encoding, Allocator> key(ptr->key.via.str.ptr, ptr->key.via.str.size, v.GetAllocator());
+                        const bool bin = (ptr->key.type == msgpack::type::BIN);
+                        if (!bin && ptr->key.type != msgpack::type::STR)
+                            throw msgpack::type_error(); // JSON object keys must be strings
+                        rapidjson::GenericValue<Encoding, Allocator> key(bin ? ptr->key.via.bin.ptr : ptr->key.via.str.ptr, bin ? ptr->key.via.bin.size : ptr->key.via.str.size, v.GetAllocator());
                         rapidjson::GenericDocument<Encoding, Allocator, StackAllocator> val(&v.GetAllocator());
                         ptr->val.convert(&val);
 
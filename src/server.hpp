@@ -0,0 +1,611 @@
+#ifndef XCHANGE_SERVER_HPP__
+#define XCHANGE_SERVER_HPP__
+
+// Long-lived conversion server.
+//
+// Every message, in both directions, is a frame: a 4 byte big-endian length
+// followed by that many bytes of payload.
+//
+//   request payload:  <src format:1> <dest format:1> <document bytes>
+//   response payload: <status:1> <converted bytes | error message>
+//
+// Each request is served by a fixed pool of worker threads, and responses on
+// one stream come back in request order. Each worker owns one Handler instance
+// for its whole life, so a Handler can keep its buffers and allocators warm
+// between requests. A Handler is default constructible and provides:
+//
+//   void operator()(const std::string& request, std::string* response);
+//
+// where `response` is a reused buffer that the handler overwrites with the
+// full response payload (status byte included).
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <set>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+namespace xchange { namespace server {
+
+    enum Status {
+        SUCCEEDED = 0,
+        FAILED = 1,
+    };
+
+    // Frames larger than this are rejected instead of being allocated.
+    static const uint32_t kMaxFrameSize = 64u * 1024u * 1024u;
+
+    // Frame payloads are read in chunks of this size, so memory is only
+    // committed for bytes that actually arrived.
+    static const size_t kReadChunk = 64 * 1024;
+
+    inline long io_read(int fd, char* data, size_t size)
+    {
+#ifdef _WIN32
+        return _read(fd, data, static_cast<unsigned int>(size));
+#else
+        ssize_t n;
+        do n = ::read(fd, data, size); while (n < 0 && errno == EINTR);
+        return static_cast<long>(n);
+#endif
+    }
+
+    inline long io_write(int fd, const char* data, size_t size)
+    {
+#ifdef _WIN32
+        return _write(fd, data, static_cast<unsigned int>(size));
+#else
+        ssize_t n;
+        do n = ::write(fd, data, size); while (n < 0 && errno == EINTR);
+        return static_cast<long>(n);
+#endif
+    }
+
+    // Reads up to `size` bytes; stops early on end of stream or error.
+    inline size_t read_up_to(int fd, char* data, size_t size, bool* error)
+    {
+        size_t done = 0;
+        while (done < size)
+        {
+            long n = io_read(fd, data + done, size - done);
+            if (n <= 0)
+            {
+                *error = (n < 0);
+                break;
+            }
+            done += static_cast<size_t>(n);
+        }
+        return done;
+    }
+
+    inline bool write_all(int fd, const char* data, size_t size)
+    {
+        while (size > 0)
+        {
+            long n = io_write(fd, data, size);
+            if (n <= 0)
+                return false;
+            data += n;
+            size -= static_cast<size_t>(n);
+        }
+        return true;
+    }
+
+    enum ReadResult {
+        READ_FRAME,     // a whole frame is in the payload
+        READ_EOF,       // the stream ended cleanly between frames
+        READ_ERROR,     // truncated or oversized frame, or I/O error
+    };
+
+    // Reads one frame into `payload`, reusing its capacity. On READ_ERROR
+    // `error` describes the problem; the stream cannot be resynchronized.
+    inline ReadResult read_frame(int fd, std::string* payload, std::string* error)
+    {
+        unsigned char header[4];
+        bool failed = false;
+        size_t n = read_up_to(fd, reinterpret_cast<char*>(header), sizeof(header), &failed);
+        if (n == 0 && !failed)
+            return READ_EOF;
+        if (n < sizeof(header))
+        {
+            *error = failed ? strerror(errno) : "Truncated frame header";
+            return READ_ERROR;
+        }
+        uint32_t size = (uint32_t(header[0]) << 24) | (uint32_t(header[1]) << 16) | (uint32_t(header[2]) << 8) | uint32_t(header[3]);
+        if (size > kMaxFrameSize)
+        {
+            *error = "Frame too large";
+            return READ_ERROR;
+        }
+
+        payload->clear();
+        while (payload->size() < size)
+        {
+            size_t offset = payload->size();
+            size_t chunk = std::min(static_cast<size_t>(size) - offset, kReadChunk);
+            payload->resize(offset + chunk);
+            n = read_up_to(fd, &(*payload)[offset], chunk, &failed);
+            if (n < chunk)
+            {
+                payload->resize(offset + n);
+                *error = failed ? strerror(errno) : "Truncated frame";
+                return READ_ERROR;
+            }
+        }
+        return READ_FRAME;
+    }
+
+    inline bool write_frame(int fd, const std::string& payload)
+    {
+        uint32_t size = static_cast<uint32_t>(payload.size());
+        unsigned char header[4] = {
+            static_cast<unsigned char>(size >> 24),
+            static_cast<unsigned char>(size >> 16),
+            static_cast<unsigned char>(size >> 8),
+            static_cast<unsigned char>(size),
+        };
+        return write_all(fd, reinterpret_cast<const char*>(header), sizeof(header))
+            && write_all(fd, payload.data(), payload.size());
+    }
+
+    // Buffers that grew past this while serving one large message are
+    // released afterwards instead of being kept for the life of the server.
+    static const size_t kRetainedCapacity = 256 * 1024;
+
+    inline void release_if_large(std::string* buffer)
+    {
+        if (buffer->capacity() > kRetainedCapacity)
+            std::string().swap(*buffer);
+    }
+
+    // Bounded blocking FIFO shared between threads. It is backed by a fixed
+    // ring, so pushing and popping never allocate.
+    template <typename T>
+    class Channel {
+    public:
+        explicit Channel(size_t capacity) : ring_(capacity), head_(0), size_(0), closed_(false) {}
+
+        bool push(T value)
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            notFull_.wait(lock, [this] { return closed_ || size_ < ring_.size(); });
+            if (closed_)
+                return false;
+            ring_[(head_ + size_) % ring_.size()] = std::move(value);
+            ++size_;
+            notEmpty_.notify_one();
+            return true;
+        }
+
+        // Returns false once the channel is closed and drained.
+        bool pop(T* value)
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            notEmpty_.wait(lock, [this] { return closed_ || size_ > 0; });
+            if (size_ == 0)
+                return false;
+            *value = std::move(ring_[head_]);
+            head_ = (head_ + 1) % ring_.size();
+            --size_;
+            notFull_.notify_one();
+            return true;
+        }
+
+        void close()
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            closed_ = true;
+            notEmpty_.notify_all();
+            notFull_.notify_all();
+        }
+
+    private:
+        std::mutex mutex_;
+        std::condition_variable notEmpty_;
+        std::condition_variable notFull_;
+        std::vector<T> ring_;
+        size_t head_;
+        size_t size_;
+        bool closed_;
+    };
+
+    template <typename Handler>
+    class ThreadPool {
+    public:
+        // Tasks only capture a pointer, so std::function stores them inline.
+        typedef std::function<void(Handler&)> Task;
+
+        explicit ThreadPool(size_t threads) : tasks_(threads * 64)
+        {
+            for (size_t i = 0; i < threads; ++i)
+                workers_.push_back(std::thread(&ThreadPool::run, this));
+        }
+        ~ThreadPool()
+        {
+            tasks_.close();
+            for (size_t i = 0; i < workers_.size(); ++i)
+                workers_[i].join();
+        }
+
+        void submit(Task task) { tasks_.push(std::move(task)); }
+
+    private:
+        ThreadPool(const ThreadPool&);
+        ThreadPool& operator=(const ThreadPool&);
+
+        void run()
+        {
+            Handler handler; // lives as long as the worker, keeps its buffers warm
+            Task task;
+            while (tasks_.pop(&task))
+                task(handler);
+        }
+
+        Channel<Task> tasks_;
+        std::vector<std::thread> workers_;
+    };
+
+    inline size_t default_threads()
+    {
+        unsigned n = std::thread::hardware_concurrency();
+        return n > 0 ? n : 1;
+    }
+
+    // One ordered stream of requests: stdin/stdout, or one socket connection.
+    // The calling thread reads frames into a ring of slots and submits each
+    // frame to the pool as its own task, so an idle stream never occupies a
+    // worker. A writer thread sends responses back in request order. Slot
+    // buffers are reused from one message to the next.
+    template <typename Handler>
+    class Session {
+    public:
+        static const size_t kDepth = 16; // requests in flight per stream
+
+        Session(ThreadPool<Handler>& pool, int in, int out)
+            : pool_(pool), in_(in), out_(out), slots_(kDepth), head_(0), count_(0), eof_(false), failed_(false)
+        {
+            for (size_t i = 0; i < slots_.size(); ++i)
+                slots_[i].session = this;
+        }
+
+        // Serves until `in` reaches EOF, a frame is malformed or `out` fails.
+        // A malformed frame is answered with a FAILED response after the
+        // requests before it. Returns false unless the stream ended cleanly.
+        bool run()
+        {
+            std::thread writer;
+            try
+            {
+                writer = std::thread(&Session::write, this);
+            }
+            catch (const std::system_error& e)
+            {
+                std::cerr << "Failed to start session: " << e.what() << std::endl;
+                return false;
+            }
+
+            bool clean = true;
+            for (;;)
+            {
+                Slot* slot = acquire();
+                if (!slot)
+                    break;
+                std::string error;
+                ReadResult result = read_frame(in_, &slot->request, &error);
+                if (result == READ_EOF)
+                    break;
+                if (result == READ_ERROR)
+                {
+                    std::cerr << "Bad request stream: " << error << std::endl;
+                    slot->response.assign(1, static_cast<char>(FAILED));
+                    slot->response.append(error);
+                    publish(true);
+                    clean = false;
+                    break;
+                }
+                publish(false);
+                pool_.submit([slot](Handler& handler) { slot->session->process(slot, handler); });
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                eof_ = true;
+                changed_.notify_all();
+            }
+            writer.join();
+            return clean && !failed_;
+        }
+
+    private:
+        Session(const Session&);
+        Session& operator=(const Session&);
+
+        struct Slot {
+            Slot() : session(NULL), ready(false) {}
+            Session* session;
+            std::string request;
+            std::string response;
+            bool ready;
+        };
+
+        // Waits for a free slot after the ones in flight.
+        Slot* acquire()
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            changed_.wait(lock, [this] { return failed_ || count_ < slots_.size(); });
+            if (failed_)
+                return NULL;
+            return &slots_[(head_ + count_) % slots_.size()];
+        }
+
+        // Hands the slot to the writer; `ready` when it needs no conversion.
+        void publish(bool ready)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            slots_[(head_ + count_) % slots_.size()].ready = ready;
+            ++count_;
+            changed_.notify_all();
+        }
+
+        void process(Slot* slot, Handler& handler)
+        {
+            handler(slot->request, &slot->response);
+            std::lock_guard<std::mutex> lock(mutex_);
+            slot->ready = true;
+            changed_.notify_all();
+        }
+
+        void write()
+        {
+            for (;;)
+            {
+                Slot* slot;
+                {
+                    std::unique_lock<std::mutex> lock(mutex_);
+                    changed_.wait(lock, [this] { return count_ > 0 ? slots_[head_].ready : eof_; });
+                    if (count_ == 0)
+                        return;
+                    slot = &slots_[head_];
+                }
+                // After a failure keep draining, so in-flight tasks can finish.
+                if (!failed_ && !write_frame(out_, slot->response))
+                    fail();
+                release_if_large(&slot->request);
+                release_if_large(&slot->response);
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    slot->ready = false;
+                    head_ = (head_ + 1) % slots_.size();
+                    --count_;
+                    changed_.notify_all();
+                }
+            }
+        }
+
+        void fail()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                failed_ = true;
+                changed_.notify_all();
+            }
+#ifndef _WIN32
+            ::shutdown(in_, SHUT_RD); // unblocks the reader on a socket
+#endif
+        }
+
+        ThreadPool<Handler>& pool_;
+        int in_;
+        int out_;
+        std::vector<Slot> slots_;
+        size_t head_;  // oldest slot in flight
+        size_t count_; // slots in flight
+        bool eof_;
+        bool failed_;
+        std::mutex mutex_;
+        std::condition_variable changed_;
+    };
+
+    // Serves framed requests read from `in`, writing responses to `out` in
+    // request order. Returns when `in` reaches EOF.
+    template <typename Handler>
+    int serve_stream(int in, int out, size_t threads)
+    {
+#ifdef _WIN32
+        _setmode(in, _O_BINARY);
+        _setmode(out, _O_BINARY);
+#endif
+        ThreadPool<Handler> pool(threads);
+        Session<Handler> session(pool, in, out);
+        return session.run() ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+#ifndef _WIN32
+    inline bool unix_address(const std::string& path, sockaddr_un* addr)
+    {
+        if (path.size() >= sizeof(addr->sun_path))
+        {
+            std::cerr << "Socket path too long: " << path << std::endl;
+            return false;
+        }
+        memset(addr, 0, sizeof(*addr));
+        addr->sun_family = AF_UNIX;
+        memcpy(addr->sun_path, path.data(), path.size());
+        return true;
+    }
+
+    // Removes a socket left behind by a server that is no longer running.
+    // Anything else at `path`, or a socket that still accepts connections,
+    // is left alone and reported.
+    inline bool remove_stale_socket(const std::string& path, const sockaddr_un& addr)
+    {
+        struct stat st;
+        if (::lstat(path.c_str(), &st) < 0)
+        {
+            if (errno == ENOENT)
+                return true;
+            std::cerr << "Failed to stat " << path << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        if (!S_ISSOCK(st.st_mode))
+        {
+            std::cerr << "Refusing to replace " << path << ": not a socket" << std::endl;
+            return false;
+        }
+
+        int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0)
+        {
+            std::cerr << "Failed to create socket: " << strerror(errno) << std::endl;
+            return false;
+        }
+        int rv = ::connect(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr));
+        int error = errno;
+        ::close(fd);
+        if (rv == 0)
+        {
+            std::cerr << "Another server is already listening on " << path << std::endl;
+            return false;
+        }
+        if (error != ECONNREFUSED)
+        {
+            std::cerr << "Failed to probe " << path << ": " << strerror(error) << std::endl;
+            return false;
+        }
+        return ::unlink(path.c_str()) == 0 || errno == ENOENT;
+    }
+
+    // Each connection costs two threads (reader and writer).
+    static const size_t kMaxConnections = 512;
+
+    // Listens on the Unix domain socket at `path` until accept fails for a
+    // reason other than a temporary lack of resources. Each connection gets
+    // its own Session, so up to kMaxConnections connections may stay open
+    // while their requests share the worker pool.
+    template <typename Handler>
+    int serve_unix(const std::string& path, size_t threads)
+    {
+        sockaddr_un addr;
+        if (!unix_address(path, &addr) || !remove_stale_socket(path, addr))
+            return EXIT_FAILURE;
+
+        signal(SIGPIPE, SIG_IGN); // a vanished client must not kill the server
+
+        int listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listener < 0)
+        {
+            std::cerr << "Failed to create socket: " << strerror(errno) << std::endl;
+            return EXIT_FAILURE;
+        }
+        if (::bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || ::listen(listener, SOMAXCONN) < 0)
+        {
+            std::cerr << "Failed to listen on " << path << ": " << strerror(errno) << std::endl;
+            ::close(listener);
+            return EXIT_FAILURE;
+        }
+
+        std::mutex mutex;
+        std::condition_variable closed;
+        std::set<int> connections;
+        ThreadPool<Handler> pool(threads);
+        for (;;)
+        {
+            {
+                // Beyond the cap, new clients wait in the listen backlog.
+                std::unique_lock<std::mutex> lock(mutex);
+                closed.wait(lock, [&connections] { return connections.size() < kMaxConnections; });
+            }
+            int fd = ::accept(listener, NULL, NULL);
+            if (fd < 0)
+            {
+                if (errno == EINTR || errno == ECONNABORTED || errno == EPROTO)
+                    continue;
+                std::cerr << "Failed to accept: " << strerror(errno) << std::endl;
+                if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)
+                {
+                    // Out of resources for now; retry once some are released.
+                    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                    continue;
+                }
+                break;
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            connections.insert(fd);
+            try
+            {
+                std::thread([&pool, &mutex, &closed, &connections, fd] {
+                    Session<Handler> session(pool, fd, fd);
+                    session.run();
+                    std::lock_guard<std::mutex> lock(mutex);
+                    ::close(fd);
+                    connections.erase(fd);
+                    closed.notify_all();
+                }).detach();
+            }
+            catch (const std::system_error& e)
+            {
+                std::cerr << "Failed to start connection thread: " << e.what() << std::endl;
+                ::close(fd);
+                connections.erase(fd);
+            }
+        }
+        ::close(listener);
+        ::unlink(path.c_str());
+
+        // Wind down open connections before the pool goes away.
+        std::unique_lock<std::mutex> lock(mutex);
+        for (std::set<int>::const_iterator i = connections.begin(); i != connections.end(); ++i)
+            ::shutdown(*i, SHUT_RDWR);
+        closed.wait(lock, [&connections] { return connections.empty(); });
+        return EXIT_FAILURE;
+    }
+
+    // Minimal client: sends one request to the server at `path` and waits for
+    // its response.
+    inline bool request_unix(const std::string& path, const std::string& request, std::string* response)
+    {
+        sockaddr_un addr;
+        if (!unix_address(path, &addr))
+            return false;
+
+        int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0 || ::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0)
+        {
+            std::cerr << "Failed to connect to " << path << ": " << strerror(errno) << std::endl;
+            if (fd >= 0)
+                ::close(fd);
+            return false;
+        }
+        std::string error;
+        bool rv = write_frame(fd, request) && read_frame(fd, response, &error) == READ_FRAME;
+        if (!error.empty())
+            std::cerr << "Failed to read response: " << error << std::endl;
+        ::close(fd);
+        return rv;
+    }
+#endif
+
+} } // namespace xchange::server
+
+#endif // XCHANGE_SERVER_HPP__
@@ -0,0 +1,215 @@
+#!/usr/bin/env python
+"""Checks `xchange --serve` against the one-shot CLI.
+
+Usage: server.py <path to xchange>
+
+Pipes framed requests into `xchange --serve -` and checks that responses come
+back in order, that conversions match what the CLI produces, and that bad
+requests get error responses without stopping the server. Then checks the
+Unix socket mode with idle connections held open, and argument validation.
+"""
+
+import json
+import os
+import shutil
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+JSON = 1
+MSGPACK = 2
+SUCCEEDED = 0
+FAILED = 1
+
+SAMPLES = [
+    {"zeta": 1, "alpha": [1, -5, 1 << 40, 18446744073709551615], "mid": {"b": None, "a": True}},
+    [0.1, -2.5, u"caf\u00e9", "", False, {}, []],
+    "plain string",
+]
+
+
+def frame(payload):
+    return struct.pack(">I", len(payload)) + payload
+
+
+def request(src, dest, body):
+    return frame(bytes(bytearray([src, dest])) + body)
+
+
+def read_frames(data):
+    frames = []
+    while data:
+        size = struct.unpack(">I", data[:4])[0]
+        frames.append(data[4:4 + size])
+        data = data[4 + size:]
+    return frames
+
+
+class Checker(object):
+    def __init__(self, xchange):
+        self.xchange = xchange
+        self.tmp = tempfile.mkdtemp()
+        self.failures = 0
+
+    def path(self, name):
+        return os.path.join(self.tmp, name)
+
+    def check(self, ok, what):
+        print("%s: %s" % ("ok" if ok else "FAIL", what))
+        if not ok:
+            self.failures += 1
+
+    def cli(self, src, dest):
+        return subprocess.call([self.xchange, "-o", dest, src]) == 0
+
+    def read(self, name):
+        with open(self.path(name), "rb") as f:
+            return f.read()
+
+    def write(self, name, data):
+        with open(self.path(name), "wb") as f:
+            f.write(data)
+
+    def msgpack_to_doc(self, data):
+        """Decodes msgpack through the CLI, so no python msgpack is needed."""
+        self.write("decode.mpack", data)
+        if not self.cli(self.path("decode.mpack"), self.path("decode.json")):
+            return None
+        return json.loads(self.read("decode.json").decode("utf-8"))
+
+    def stream(self):
+        requests, expected = [], []
+        for i, sample in enumerate(SAMPLES):
+            text = json.dumps(sample).encode("utf-8")
+            self.write("%d.json" % i, text)
+            self.check(self.cli(self.path("%d.json" % i), self.path("%d.mpack" % i)), "CLI json -> msgpack %d" % i)
+            packed = self.read("%d.mpack" % i)
+            requests.append(request(JSON, MSGPACK, text))
+            expected.append(("msgpack", sample))
+            requests.append(request(MSGPACK, JSON, packed))
+            expected.append(("json", sample))
+
+        bad = [
+            ("malformed JSON", request(JSON, MSGPACK, b"{\"a\": ")),
+            ("data after an embedded NUL", request(JSON, MSGPACK, b"[1]\0[2]")),
+            ("deeply nested JSON", request(JSON, MSGPACK, b"[" * 100000 + b"]" * 100000)),
+            ("truncated msgpack", request(MSGPACK, JSON, b"\x92\x01")),
+            ("msgpack map with an integer key", request(MSGPACK, JSON, b"\x81\x01\x02")),
+            ("deeply nested msgpack", request(MSGPACK, JSON, b"\x91" * 100000 + b"\xc0")),
+            ("msgpack array longer than the frame", request(MSGPACK, JSON, b"\xdd\xff\xff\xff\xff")),
+            ("NaN", request(MSGPACK, JSON, b"\xcb\x7f\xf8\0\0\0\0\0\0")),
+            ("Inf inside an array", request(MSGPACK, JSON, b"\x92\x01\xcb\x7f\xf0\0\0\0\0\0\0")),
+            ("unsupported format pair", request(JSON, JSON, b"[]")),
+            ("request without formats", frame(b"\x01")),
+        ]
+        for name, data in bad:
+            requests.append(data)
+            expected.append(("error", name))
+
+        # Repeat the whole batch so responses are produced concurrently.
+        rounds = 20
+        data = b"".join(requests) * rounds + struct.pack(">I", 0xffffffff)
+        returncode, responses = self.serve_stdin(data)
+        self.check(returncode != 0, "--serve - fails after an oversized frame")
+        self.check(len(responses) == len(expected) * rounds + 1, "one response per request, then one for the bad frame")
+        self.check(responses[-1:] == [b"\x01Frame too large"], "oversized frame gets a FAILED response")
+        for i, response in enumerate(responses[:len(expected) * rounds]):
+            kind, value = expected[i % len(expected)]
+            status, body = bytearray(response[:1]), response[1:]
+            if kind == "error":
+                ok = status == bytearray([FAILED]) and len(body) > 0
+                what = "error response for %s" % value
+            elif kind == "json":
+                ok = status == bytearray([SUCCEEDED]) and json.loads(body.decode("utf-8")) == value
+                what = "msgpack -> json matches the CLI input"
+            else:
+                ok = status == bytearray([SUCCEEDED]) and self.msgpack_to_doc(body) == value
+                what = "json -> msgpack decodes back via the CLI"
+            if not ok or i < len(expected):
+                self.check(ok, "#%d %s" % (i, what))
+
+        for name, data, message in (("truncated frame", request(JSON, MSGPACK, b"[]")[:-1], b"Truncated frame"),
+                                    ("truncated frame header", b"\0\0", b"Truncated frame header")):
+            returncode, responses = self.serve_stdin(request(JSON, MSGPACK, b"[]") + data)
+            self.check(returncode != 0 and len(responses) == 2 and responses[0][:1] == b"\0"
+                       and responses[1] == b"\x01" + message,
+                       "--serve - answers and fails on a %s" % name)
+
+        returncode, responses = self.serve_stdin(b"")
+        self.check(returncode == 0 and responses == [], "--serve - exits cleanly on empty input")
+
+    def serve_stdin(self, data):
+        proc = subprocess.Popen([self.xchange, "--serve", "-", "--threads", "4"],
+                                stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+        out, _ = proc.communicate(data)
+        return proc.returncode, read_frames(out)
+
+    def unix_socket(self):
+        if not hasattr(socket, "AF_UNIX"):
+            return
+        sock = self.path("xchange.sock")
+        server = subprocess.Popen([self.xchange, "--serve", sock, "--threads", "1"])
+        try:
+            for _ in range(100):
+                if os.path.exists(sock):
+                    break
+                time.sleep(0.05)
+            idle = []
+            for _ in range(3):
+                s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+                s.connect(sock)
+                idle.append(s)
+
+            self.write("in.json", json.dumps(SAMPLES[0]).encode("utf-8"))
+            client = subprocess.Popen([self.xchange, "--connect", sock, "-o", self.path("out.mpack"), self.path("in.json")])
+            deadline = time.time() + 5
+            while client.poll() is None and time.time() < deadline:
+                time.sleep(0.05)
+            if client.poll() is None:
+                client.kill()
+            self.check(client.returncode == 0, "--connect is served while other connections sit idle")
+            self.check(client.returncode == 0 and self.msgpack_to_doc(self.read("out.mpack")) == SAMPLES[0],
+                       "--connect result decodes back to the input")
+
+            self.check(subprocess.call([self.xchange, "--serve", sock]) != 0,
+                       "--serve refuses a socket that another server is using")
+            for s in idle:
+                s.close()
+        finally:
+            server.kill()
+            server.wait()
+
+        self.write("keep.txt", b"keep")
+        self.check(subprocess.call([self.xchange, "--serve", self.path("keep.txt")]) != 0
+                   and self.read("keep.txt") == b"keep",
+                   "--serve refuses to replace a regular file")
+
+    def arguments(self):
+        for args in (["--serve", "-", "--threads", "abc"],
+                     ["--serve", "-", "--threads", "-4"],
+                     ["--serve", "-", "-o", "out.json"],
+                     ["--serve", "-", "--connect", "sock"],
+                     ["--serve", "-", "--threads", "99999999999999999999"],
+                     ["--serve", "-", "--threads", "100000"],
+                     ["--threads", "2", "-o", "out.json", "in.mpack"],
+                     ["a.json", "b.json", "-o", "out.mpack"]):
+            self.check(subprocess.call([self.xchange] + args) != 0, "rejects %s" % " ".join(args))
+
+    def run(self):
+        try:
+            self.stream()
+            self.unix_socket()
+            self.arguments()
+        finally:
+            shutil.rmtree(self.tmp)
+        return 1 if self.failures else 0
+
+
+if __name__ == "__main__":
+    if len(sys.argv) != 2:
+        sys.stderr.write(__doc__)
+        sys.exit(2)
+    sys.exit(Checker(os.path.abspath(sys.argv[1])).run())